@@ -7,75 +7,75 @@
 #include <unistd.h>
 #include <getopt.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "argv.h"
 
-static void *_realloc_argv(char *argv[], int old_size, int new_size)
+/* Returns the string for element 'i' of the table at 'idx' (pushed on
+ * the stack, to keep it alive), or NULL if there's no such element. */
+static const char *_get_arg(lua_State *l, int idx, int i)
 {
-  char **new_argv = malloc(sizeof(char **) * new_size);
+  /* Grab lua table element in index "idx" */
+  lua_pushnumber(l, i);
+  lua_gettable(l, idx);
 
-  if (argv) {
-    memcpy(new_argv, argv, sizeof(char **) * old_size);
-    free(argv);
+  /* If the element on the top of the stack is nil, we're done. */
+  if (lua_type(l, -1) == LUA_TNIL) {
+    return NULL;
   }
 
-  return new_argv;
-}
-
-static void _add_arg(int *argv_size, int *argcp, char **argvp[], const char *new_arg)
-{
-  /* Make sure we have space for both the new element and the ending NULL 
-   * terminating element. If not, make a newer, larger array. */
-  if (*argcp+2 > *argv_size) {
-    int new_argv_size = *argv_size * 2;
-    *argvp = _realloc_argv(*argvp, *argv_size, new_argv_size);
-    *argv_size = new_argv_size;
+  /* Avoid calling lua_tolstring on a number; that would convert the 
+   * actual element on the stack to a LUA_TSTRING, which apparently 
+   * confuses Lua's iterators. */
+  if (lua_type(l, -1) == LUA_TNUMBER) {
+    lua_pushfstring(l, "%f", lua_tonumber(l, -1));
+    lua_remove(l, -2); /* Leave just the fstring on the stack */
+  }
+  else if (lua_type(l, -1) != LUA_TSTRING) {
+    /* Buh? Has someone been messing with arg[]? */
+    lua_pop(l, 1);
+    lua_pushstring(l, "(null)");
   }
 
-  (*argvp)[*argcp] = malloc(strlen(new_arg)+1);
-  strcpy((*argvp)[*argcp], new_arg);
-  (*argcp)++;
+  return lua_tostring(l, -1);
 }
 
+/* Build argv from the table at 'idx'. The strings are stored back to
+ * back in the same allocation as the argv array itself (after its NULL
+ * terminator), so a very large argv costs two mallocs rather than one
+ * per element. */
 int construct_args(lua_State *l, int idx, int *argcp, char ***argvp)
 {
-  int i=0;
-  int argv_size = 10;
-  *argvp = _realloc_argv(NULL, 0, argv_size);
-  *argcp = 0;
-
-  while (1) {
-    /* Grab lua table element in index "idx" */
-    lua_pushnumber(l, i);
-    lua_gettable(l, idx);
-
-    /* If the element on the top of the stack is nil, we're done. */
-    if (lua_type(l, -1) == LUA_TNIL) {
-      lua_pop(l, 1); /* Pop the NIL off the stack */
-      break;
-    } 
-
-    /* Avoid calling lua_tolstring on a number; that would convert the 
-     * actual element on the stack to a LUA_TSTRING, which apparently 
-     * confuses Lua's iterators. */
-    if (lua_type(l, -1) == LUA_TNUMBER) {
-      const char *new_string;
-
-      lua_pushfstring(l, "%f", lua_tonumber(l, -1));
-      new_string = lua_tostring(l, -1);
-      _add_arg(&argv_size, argcp, argvp, new_string);
-      lua_pop(l, 1); /* Pop the fstring off the stack */
-    }
-    else if (lua_type(l, -1) == LUA_TSTRING) {
-      const char *new_string = lua_tostring(l, -1);
-      _add_arg(&argv_size, argcp, argvp, new_string);
-    }
-    else {
-      /* Buh? Has someone been messing with arg[]? */
-      _add_arg(&argv_size, argcp, argvp, "(null)");
-    }
-    lua_pop(l, 1); /* Pop the return value off the stack */
-    
-    i++;
+  int i;
+  size_t len, total = 0;
+  const char *s;
+  char *strings;
+
+  /* First pass: count the elements and the space their strings need.
+   * Like any C argv, each string ends at its first NUL; classify_args()
+   * depends on there being exactly one NUL per element. */
+  for (i=0; (s = _get_arg(l, idx, i)); i++) {
+    total += strlen(s) + 1;
+    lua_pop(l, 1); /* Pop the string off the stack */
+  }
+  lua_pop(l, 1); /* Pop the NIL off the stack */
+
+  *argcp = i;
+  *argvp = malloc(sizeof(char *) * (i+1) + total);
+  strings = (char *)(*argvp + i + 1);
+
+  /* Second pass: copy them in. */
+  for (i=0; i<*argcp; i++) {
+    s = _get_arg(l, idx, i);
+    len = strlen(s);
+    memcpy(strings, s, len + 1);
+    (*argvp)[i] = strings;
+    strings += len + 1;
+    lua_pop(l, 1); /* Pop the string off the stack */
   }
   (*argvp)[(*argcp)] = NULL;
 
@@ -83,12 +83,145 @@ int construct_args(lua_State *l, int idx, int *argcp, char ***argvp)
   return i;
 }
 
-void free_args(int argc, char *argv[])
+/* Copy argv back into the table at 'idx' after getopt has permuted it.
+ * Entries that getopt didn't move, and that were strings (without
+ * embedded NULs) to begin with, are already right, so they're skipped; when most of a very large argv
+ * is operands that never moved, that's most of the work. Everything
+ * else is written back as the string construct_args() made of it, as
+ * it always has been. 'orig_argv' is the argv as construct_args()
+ * built it. */
+void update_args(lua_State *l, int idx, int argc, char *argv[],
+		 char *orig_argv[])
+{
+  int i;
+  for (i=0; i<argc; i++) {
+    if (argv[i] == orig_argv[i]) {
+      int same = 0;
+      size_t len;
+
+      lua_rawgeti(l, idx, i);
+      if (lua_type(l, -1) == LUA_TSTRING) {
+	lua_tolstring(l, -1, &len);
+	same = (len == strlen(argv[i]));
+      }
+      lua_pop(l, 1);
+      if (same) {
+	continue;
+      }
+    }
+    lua_pushinteger(l, i);
+    lua_pushstring(l, argv[i]);
+    lua_rawset(l, idx);
+  }
+}
+
+/* Classify one token; for ARG_LONG_VALUE, *eq is set to the offset of
+ * the '='. */
+int classify_arg(const char *s, int *eq)
+{
+  const char *e;
+
+  *eq = -1;
+  if (s[0] != '-') {
+    return ARG_OPERAND;
+  }
+  if (s[1] == 0) {
+    return ARG_DASH;
+  }
+  if (s[1] != '-') {
+    return ARG_SHORT;
+  }
+  if (s[2] == 0) {
+    return ARG_TERMINATOR;
+  }
+  e = strchr(s+2, '=');
+  if (e) {
+    *eq = e - s;
+    return ARG_LONG_VALUE;
+  }
+  return ARG_LONG;
+}
+
+#if defined(__AVX2__)
+#define SIMD_WIDTH 32
+#define SIMD_MASK(p, c) ((unsigned long long)(unsigned int)		\
+  _mm256_movemask_epi8(_mm256_cmpeq_epi8(				\
+    _mm256_loadu_si256((const __m256i *)(p)), _mm256_set1_epi8(c))))
+#elif defined(__SSE2__)
+#define SIMD_WIDTH 16
+#define SIMD_MASK(p, c) ((unsigned long long)(unsigned int)		\
+  _mm_movemask_epi8(_mm_cmpeq_epi8(					\
+    _mm_loadu_si128((const __m128i *)(p)), _mm_set1_epi8(c))))
+#endif
+
+/* Classify every element of an argv built by construct_args(), before
+ * getopt gets a chance to permute it. type[i] gets one of the ARG_*
+ * values and eq[i] the offset of the '=' in an ARG_LONG_VALUE (or -1).
+ *
+ * Only tokens that start with '-' need a closer look. Since
+ * construct_args() stores the strings back to back, a token starts
+ * wherever the previous byte was a NUL; with SSE2/AVX2 we find the
+ * token starts and '-' bytes a block at a time, and skip whole blocks
+ * of operands without looking at the tokens in them individually. */
+void classify_args(int argc, char *argv[], unsigned char *type, int *eq)
 {
   int i;
+
+  memset(type, ARG_OPERAND, argc);
+  for (i=0; i<argc; i++) {
+    eq[i] = -1;
+  }
+  if (argc == 0) {
+    return;
+  }
+
+#ifdef SIMD_WIDTH
+  {
+    const char *base = argv[0];
+    size_t n = argv[argc-1] + strlen(argv[argc-1]) + 1 - base;
+    size_t pos = 0;
+    unsigned long long prev_nul = 1; /* the first byte starts a token */
+    int tok = 0;                      /* tokens started before 'pos' */
+
+    for (; pos + SIMD_WIDTH <= n; pos += SIMD_WIDTH) {
+      unsigned long long nul = SIMD_MASK(base + pos, 0);
+      unsigned long long dash = SIMD_MASK(base + pos, '-');
+      unsigned long long starts = ((nul << 1) | prev_nul) &
+	((1ULL << SIMD_WIDTH) - 1);
+      unsigned long long opts = starts & dash;
+
+      prev_nul = nul >> (SIMD_WIDTH - 1);
+      while (opts) {
+	int t = tok + __builtin_popcountll(starts & ((opts & -opts) - 1));
+	type[t] = classify_arg(argv[t], &eq[t]);
+	opts &= opts - 1;
+      }
+      tok += __builtin_popcountll(starts);
+    }
+
+    /* Whatever's left is less than a block */
+    for (; pos < n; pos++) {
+      if (prev_nul) {
+	if (base[pos] == '-') {
+	  type[tok] = classify_arg(argv[tok], &eq[tok]);
+	}
+	tok++;
+      }
+      prev_nul = (base[pos] == 0);
+    }
+  }
+#else
   for (i=0; i<argc; i++) {
-    free(argv[i]);
+    if (argv[i][0] == '-') {
+      type[i] = classify_arg(argv[i], &eq[i]);
+    }
   }
+#endif
+}
+
+void free_args(int argc, char *argv[])
+{
+  /* The strings live in the same allocation as argv */
   free(argv);
 }
 
@@ -1,3 +1,16 @@
+/* Token classes, from classify_arg() and classify_args() */
+enum {
+  ARG_OPERAND,     /* doesn't start with '-' */
+  ARG_SHORT,       /* "-x", or a cluster like "-xyz" */
+  ARG_LONG,        /* "--name" */
+  ARG_LONG_VALUE,  /* "--name=value" */
+  ARG_DASH,        /* "-" on its own, which is an operand */
+  ARG_TERMINATOR   /* "--" */
+};
+
 int construct_args(lua_State *l, int idx, int *argcp, char ***argvp);
+void update_args(lua_State *l, int idx, int argc, char *argv[],
+		 char *orig_argv[]);
+int classify_arg(const char *s, int *eq);
+void classify_args(int argc, char *argv[], unsigned char *type, int *eq);
 void free_args(int argc, char *argv[]);
-
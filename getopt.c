@@ -9,6 +9,8 @@
 
 #include "argv.h"
 #include "options.h"
+#include "parser.h"
+#include "stream.h"
 #include "set-lua-variable.h"
 
 #define MODULENAME      "getopt"
@@ -45,7 +47,7 @@ static int lgetopt_std(lua_State *l)
   const char *optstring = NULL;
   int result = 1; /* assume success */
   int argc, ch;
-  char **argv = NULL;
+  char **argv = NULL, **orig_argv = NULL;
 
   int numargs = lua_gettop(l);
   if (numargs != 2 ||
@@ -61,6 +63,10 @@ static int lgetopt_std(lua_State *l)
   construct_args(l, lua_gettop(l), &argc, &argv);
   lua_pop(l, 1);
 
+  /* Remember the original order, so we only write back what moves. */
+  orig_argv = malloc(sizeof(char *) * (argc+1));
+  memcpy(orig_argv, argv, sizeof(char *) * (argc+1));
+
   /* Parse the options and store them in the Lua table. */
   while ((ch=getopt(argc, argv, optstring)) > -1) {
     char buf[2] = { ch, 0 };
@@ -89,12 +95,9 @@ static int lgetopt_std(lua_State *l)
    * will leave index [-1] alone if it's set (as it sometimes is). */
 
   lua_getglobal(l, "arg");
-  int i;
-  for (i=0; i<argc; i++) {
-    lua_pushinteger(l, i);
-    lua_pushstring(l, argv[i]);
-    lua_rawset(l, -3);
-  }
+  update_args(l, lua_gettop(l), argc, argv, orig_argv);
+  lua_pop(l, 1);
+  free(orig_argv);
 
   free_args(argc, argv);
 
@@ -183,9 +186,153 @@ static int loptarg(lua_State *l)
   return 1;
 }
 
-/* bool result = getopt.long("opts", longopts_in[, opts_out[, error_function]])
+/* One entry in the (optional) ordered log of every option matched. */
+struct occurrence {
+  char key[2];        /* same key as in the result table */
+  const char *name;   /* long option name, if there's no key */
+  int token;          /* index of the argv token the option appeared in */
+  const char *optarg; /* points into argv; NULL if no argument */
+};
+
+/* Find which token of orig_argv the string p is. construct_args()
+ * lays the strings out in order, so orig_argv is sorted by address. */
+static int _orig_index(char *orig_argv[], int argc, const char *p)
+{
+  int lo = 0, hi = argc - 1;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (orig_argv[mid] < p) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* Enough of getopt's state to trace each option it returns back to the
+ * token it came from. */
+struct scan {
+  char **orig_argv;     /* the original order */
+  char **argv;          /* the order getopt has permuted it into */
+  int argc;
+  unsigned char *type;  /* classify_args() of the original order */
+  int from;             /* optind before the latest call to getopt */
+  int cluster;          /* short option cluster we're part way through... */
+  int offset;           /* ... and the offset of its next option char */
+};
+
+/* Return the (original) index of the token that the option getopt just
+ * returned came from. */
+static int _option_token(struct scan *s, int was_long)
+{
+  int t;
+
+  if (!was_long && s->cluster != -1) {
+    /* getopt finishes a cluster whatever optind says */
+    t = s->cluster;
+  } else {
+    /* getopt started looking at argv[from], skipping operands (which it
+     * permutes later). It hasn't permuted anything from there on, so we
+     * can skip them in the original order. Going by optind rather than
+     * keeping our own count means that a callback which moves optind
+     * moves us too. */
+    int from = s->from ? s->from : 1;
+
+    t = from < s->argc ? _orig_index(s->orig_argv, s->argc, s->argv[from])
+		       : s->argc;
+    while (t < s->argc &&
+	   (s->type[t] == ARG_OPERAND || s->type[t] == ARG_DASH)) {
+      t++;
+    }
+    s->cluster = was_long ? -1 : t;
+    s->offset = 1;
+  }
+
+  if (!was_long) {
+    s->offset++;
+    if (optarg || s->orig_argv[t][s->offset] == 0) {
+      /* the argument (or the end of the token) ends the cluster */
+      s->cluster = -1;
+    }
+  }
+
+  return t;
+}
+
+static void _log_occurrence(struct occurrence **log, int *log_size,
+			    int *log_count, const char *key,
+			    struct option *longopt, int token)
+{
+  struct occurrence *o;
+
+  if (*log_count == *log_size) {
+    *log_size *= 2;
+    *log = realloc(*log, sizeof(struct occurrence) * (*log_size));
+  }
+
+  o = &(*log)[(*log_count)++];
+  o->key[0] = key[0];
+  o->key[1] = 0;
+  o->name = longopt ? longopt->name : NULL;
+  o->token = token;
+  o->optarg = optarg;
+}
+
+/* Store the log as three parallel arrays - opt, index and optarg - in
+ * the table at table_idx. index is where the option's token is in
+ * 'arg' once getopt has moved the operands to the end. Options without
+ * an argument get 'false' in optarg, so that none of the arrays have
+ * holes. */
+static void _push_log(lua_State *l, int table_idx,
+		      struct occurrence *log, int log_count,
+		      int argc, char *argv[], char *orig_argv[])
+{
+  int i;
+  int *final = malloc(sizeof(int) * (argc > 0 ? argc : 1));
+
+  for (i=0; i<argc; i++) {
+    final[_orig_index(orig_argv, argc, argv[i])] = i;
+  }
+
+  lua_createtable(l, log_count, 0);
+  for (i=0; i<log_count; i++) {
+    if (log[i].key[0] || !log[i].name) {
+      lua_pushstring(l, log[i].key);
+    } else {
+      lua_pushstring(l, log[i].name);
+    }
+    lua_rawseti(l, -2, i+1);
+  }
+  lua_setfield(l, table_idx, "opt");
+
+  lua_createtable(l, log_count, 0);
+  for (i=0; i<log_count; i++) {
+    lua_pushinteger(l, final[log[i].token]);
+    lua_rawseti(l, -2, i+1);
+  }
+  lua_setfield(l, table_idx, "index");
+
+  lua_createtable(l, log_count, 0);
+  for (i=0; i<log_count; i++) {
+    if (log[i].optarg) {
+      lua_pushstring(l, log[i].optarg);
+    } else {
+      lua_pushboolean(l, 0);
+    }
+    lua_rawseti(l, -2, i+1);
+  }
+  lua_setfield(l, table_idx, "optarg");
+
+  free(final);
+}
+
+/* bool result = getopt.long("opts", longopts_in[, opts_out[, error_function[, log_out]]])
  *
  * Uses the libc getopt_long() call and stuffs results in the given table.
+ * If log_out is given, every option matched is also recorded there, in
+ * argv order (see _push_log).
  */
 
 typedef int (*func_t)(int argc, char * const *argv, const char *optstring,
@@ -196,26 +343,32 @@ static int lgetopt_long_t(lua_State *l, func_t func)
   const char *optstring = NULL;
   int result = 1; /* assume success */
   int argc, ch, idx;
-  char **argv = NULL;
+  char **argv = NULL, **orig_argv = NULL;
   int error_func = 0;
 
   int numargs = lua_gettop(l);
-  if ((numargs != 2 && numargs != 3 && numargs != 4) ||
+  if ((numargs < 2 || numargs > 5) ||
       lua_type(l,1) != LUA_TSTRING ||
       lua_type(l,2) != LUA_TTABLE ||
       (numargs >= 3 && 
        (lua_type(l,3) != LUA_TTABLE && 
 	lua_type(l,3) != LUA_TNIL))) {
-    ERROR("usage: getopt.long(optionstring, longopts[, resulttable[, errorfunc]])");
+    ERROR("usage: getopt.long(optionstring, longopts[, resulttable[, errorfunc[, logtable]]])");
   }
-  if (numargs == 4 &&
+  if (numargs >= 4 &&
       lua_type(l,4) != LUA_TFUNCTION && 
       lua_type(l,4) != LUA_TNIL) {
-    ERROR("usage: getopt.long(optionstring, longopts[, resulttable[, errorfunc]])");
+    ERROR("usage: getopt.long(optionstring, longopts[, resulttable[, errorfunc[, logtable]]])");
+  }
+  if (numargs == 5 &&
+      lua_type(l,5) != LUA_TTABLE &&
+      lua_type(l,5) != LUA_TNIL) {
+    ERROR("usage: getopt.long(optionstring, longopts[, resulttable[, errorfunc[, logtable]]])");
   }
-  if (numargs == 4 && lua_type(l,4) == LUA_TFUNCTION) {
+  if (numargs >= 4 && lua_type(l,4) == LUA_TFUNCTION) {
     // We can't copy the error function - but we can make a
     // registry pointer.
+    lua_pushvalue(l, 4);
     error_func = luaL_ref(l, LUA_REGISTRYINDEX);
   }
 
@@ -226,12 +379,29 @@ static int lgetopt_long_t(lua_State *l, func_t func)
   construct_args(l, lua_gettop(l), &argc, &argv);
   lua_pop(l, 1);
 
+  /* Remember the original order, so we only write back what moves. */
+  orig_argv = malloc(sizeof(char *) * (argc+1));
+  memcpy(orig_argv, argv, sizeof(char *) * (argc+1));
+
   /* Construct a longopts struct from the one given. */
   char **bound_variable_name = NULL;
   int *bound_variable_value = NULL;
   struct option *longopts = build_longopts(l, 2, 
 					   &bound_variable_name,
 					   &bound_variable_value);
+  struct constraints *constraints = build_constraints(l, 2, longopts);
+
+  /* Set up the occurrence log, if one was asked for. */
+  struct occurrence *log = NULL;
+  int log_size = argc > 0 ? argc : 1, log_count = 0;
+  struct scan scan = { orig_argv, argv, argc, NULL, optind, -1, 0 };
+  if (numargs == 5 && lua_type(l,5) == LUA_TTABLE) {
+    int *eq = malloc(sizeof(int) * log_size);
+    log = malloc(sizeof(struct occurrence) * log_size);
+    scan.type = malloc(log_size);
+    classify_args(argc, argv, scan.type, eq);
+    free(eq);
+  }
 
   /* Parse the options and store them in the Lua table. */
   idx = -1; /* initialize idx to -1 so we can tell whether or not it's
@@ -239,6 +409,7 @@ static int lgetopt_long_t(lua_State *l, func_t func)
 
   while ((ch=func(argc, argv, optstring, longopts, &idx)) > -1) {
     char buf[2] = { ch, 0 };
+    int was_long = (idx != -1);
 
     if (ch == '?' || ch == ':') {
       /* This is a special "got a bad option" character. Don't put it 
@@ -292,9 +463,19 @@ static int lgetopt_long_t(lua_State *l, func_t func)
       }
     }
 
+    /* Log the match before any callback gets a chance to move optind. */
+    if (log) {
+      _log_occurrence(&log, &log_size, &log_count, buf,
+		      idx != -1 ? &longopts[idx] : NULL,
+		      _option_token(&scan, was_long));
+    }
+
     /* Call any available callbacks for this element, if we found the
      * element in the longopts struct list. */
     if (idx != -1) {
+      if (constraints) {
+	mark_option(constraints, idx);
+      }
       _call_callback(l, 2, &longopts[idx]);
     }
 
@@ -315,6 +496,23 @@ static int lgetopt_long_t(lua_State *l, func_t func)
     }
 
     idx = -1;
+    scan.from = optind; /* where getopt will carry on from next time */
+  }
+
+  if (log) {
+    /* optarg points into argv, so this has to happen before free_args() */
+    _push_log(l, 5, log, log_count, argc, argv, orig_argv);
+    free(log);
+    free(scan.type);
+  }
+
+  /* Now that we've seen everything, check it against any conflicts,
+   * requires, required or max_count constraints. All of the violations
+   * are reported, not just the first. */
+  if (result && constraints &&
+      !check_constraints(l, constraints, longopts,
+			 argc ? argv[0] : MODULENAME, error_func)) {
+    result = 0;
   }
 
   /* Since the default behavior of many (but not all) getopt libraries is to 
@@ -324,13 +522,11 @@ static int lgetopt_long_t(lua_State *l, func_t func)
    * will leave index [-1] in place if it's set (as it sometimes is). */
 
   lua_getglobal(l, "arg");
-  int i;
-  for (i=0; i<argc; i++) {
-    lua_pushinteger(l, i);
-    lua_pushstring(l, argv[i]);
-    lua_rawset(l, -3);
-  }
+  update_args(l, lua_gettop(l), argc, argv, orig_argv);
+  lua_pop(l, 1);
+  free(orig_argv);
 
+  free_constraints(constraints);
   free_longopts(longopts, bound_variable_name, bound_variable_value);
   free_args(argc, argv);
 
@@ -366,6 +562,9 @@ static const struct luaL_Reg methods[] = {
   { "std",          lgetopt_std       },
   { "long",         lgetopt_long      },
   { "long_only",    lgetopt_long_only },
+  { "parse",        lgetopt_parse     },
+  { "parser",       lgetopt_parser    },
+  { "stream",       lgetopt_stream    },
   { "get_optind",   loptind           },
   { "set_optind",   lsoptind          },
   { "get_optopt",   loptopt           },
@@ -410,6 +609,9 @@ int luaopen_getopt(lua_State *l)
                                          metatable.__metatable = methods */
   lua_pop(l, 1);                      /* drop metatable */
 
+  register_parser(l);
+  register_stream(l);
+
   return 1;                           /* return methods on the stack */
 
 }
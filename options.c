@@ -8,6 +8,7 @@
 #include <getopt.h>
 
 #include "argv.h"
+#include "options.h"
 
 #define ERROR(x) { lua_pushstring(l, x); lua_error(l); }
 #define getn(L,n) (luaL_checktype(L, n, LUA_TTABLE), luaL_getn(L, n))
@@ -78,8 +79,13 @@ static void _populate_option(lua_State *l,
 	    p->val = val[0];
 	  }
 	}
-      } else if (strcmp(new_string, "callback")) {
-	ERROR("error: longopts must be {has_arg|flag|val|callback}");
+      } else if (strcmp(new_string, "callback") &&
+		 strcmp(new_string, "conflicts") &&
+		 strcmp(new_string, "requires") &&
+		 strcmp(new_string, "required") &&
+		 strcmp(new_string, "max_count")) {
+	/* The constraint keys are compiled by build_constraints() */
+	ERROR("error: longopts must be {has_arg|flag|val|callback|conflicts|requires|required|max_count}");
       }
 
     } else {
@@ -129,7 +135,7 @@ struct option * build_longopts(lua_State *l,
   memset(*bound_variable_value, 0, sizeof(int*) * num_opts);
 
   // alloc longopts, plus room for NULL terminator
-  struct option *ret = malloc(sizeof(struct option) * num_opts+1);
+  struct option *ret = malloc(sizeof(struct option) * (num_opts+1));
   int i = 0;
 
   // loop over the elements; for each, create a longopts struct
@@ -177,3 +183,234 @@ void free_longopts(struct option *longopts,
   free(bound_variable_name);
   free(bound_variable_value);
 }
+
+#define WORD_BITS (sizeof(unsigned long) * 8)
+#define SET_BIT(mask, i) ((mask)[(i) / WORD_BITS] |= 1UL << ((i) % WORD_BITS))
+#define TEST_BIT(mask, i) ((mask)[(i) / WORD_BITS] & (1UL << ((i) % WORD_BITS)))
+
+static struct constraints *_alloc_constraints(int num_opts)
+{
+  struct constraints *c = malloc(sizeof(struct constraints));
+
+  c->num_opts = num_opts;
+  c->nwords = (num_opts + WORD_BITS - 1) / WORD_BITS;
+  c->required = calloc(c->nwords, sizeof(unsigned long));
+  c->conflicts = calloc(num_opts * c->nwords, sizeof(unsigned long));
+  c->requires = calloc(num_opts * c->nwords, sizeof(unsigned long));
+  c->max_count = calloc(num_opts, sizeof(int));
+  c->seen = calloc(c->nwords, sizeof(unsigned long));
+  c->count = calloc(num_opts, sizeof(int));
+
+  return c;
+}
+
+static int _find_option(struct option *longopts, const char *name)
+{
+  int i;
+
+  for (i=0; longopts[i].name; i++) {
+    if (!strcmp(longopts[i].name, name)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Set the bit for each option named by the string (or list of
+ * strings) on the top of the stack. */
+static void _set_bits(lua_State *l, unsigned long *mask,
+		      struct option *longopts)
+{
+  int top = lua_gettop(l);
+  int i;
+
+  if (lua_type(l, top) == LUA_TSTRING) {
+    const char *name = lua_tostring(l, top);
+    i = _find_option(longopts, name);
+    if (i == -1) {
+      luaL_error(l, "error: conflicts/requires names unknown option '%s'", name);
+    }
+    SET_BIT(mask, i);
+  } else if (lua_type(l, top) == LUA_TTABLE) {
+    lua_pushnil(l);
+    while (lua_next(l, top) != 0) {
+      if (lua_type(l, -1) != LUA_TSTRING) {
+	ERROR("error: conflicts/requires must be a string or list of strings");
+      }
+      const char *name = lua_tostring(l, -1);
+      i = _find_option(longopts, name);
+      if (i == -1) {
+	luaL_error(l, "error: conflicts/requires names unknown option '%s'", name);
+      }
+      SET_BIT(mask, i);
+      lua_pop(l, 1);
+    }
+  } else {
+    ERROR("error: conflicts/requires must be a string or list of strings");
+  }
+}
+
+/* Compile any conflicts/requires/required/max_count constraints in
+ * the longopts table into per-option bitmasks. Must be called on the
+ * same (unmodified) table as build_longopts(), so that lua_next()
+ * visits the options in the same order. Returns NULL if there are no
+ * constraints at all. */
+struct constraints * build_constraints(lua_State *l,
+				       int table_idx,
+				       struct option *longopts)
+{
+  struct constraints *c = NULL;
+  int num_opts = 0;
+  int i = 0;
+
+  while (longopts[num_opts].name) {
+    num_opts++;
+  }
+
+  lua_pushnil(l);
+  while (lua_next(l, table_idx) != 0) {
+    int opt_idx = lua_gettop(l);
+
+    lua_getfield(l, opt_idx, "conflicts");
+    lua_getfield(l, opt_idx, "requires");
+    lua_getfield(l, opt_idx, "required");
+    lua_getfield(l, opt_idx, "max_count");
+
+    if (!c &&
+	!(lua_isnil(l, -4) && lua_isnil(l, -3) &&
+	  lua_isnil(l, -2) && lua_isnil(l, -1))) {
+      c = _alloc_constraints(num_opts);
+    }
+
+    if (!lua_isnil(l, -1)) {
+      if (!lua_isnumber(l, -1) || lua_tonumber(l, -1) < 1) {
+	ERROR("error: max_count must be a positive number");
+      }
+      c->max_count[i] = lua_tonumber(l, -1);
+    }
+    lua_pop(l, 1);
+
+    if (lua_toboolean(l, -1)) {
+      SET_BIT(c->required, i);
+    }
+    lua_pop(l, 1);
+
+    if (!lua_isnil(l, -1)) {
+      _set_bits(l, &c->requires[i * c->nwords], longopts);
+    }
+    lua_pop(l, 1);
+
+    if (!lua_isnil(l, -1)) {
+      _set_bits(l, &c->conflicts[i * c->nwords], longopts);
+    }
+    lua_pop(l, 2); // pop conflicts and value; leave key
+    i++;
+  }
+
+  return c;
+}
+
+/* Forget every option seen, ready for another parse. */
+void reset_constraints(struct constraints *c)
+{
+  memset(c->seen, 0, sizeof(unsigned long) * c->nwords);
+  memset(c->count, 0, sizeof(int) * c->num_opts);
+}
+
+/* Record that option 'idx' was seen. */
+void mark_option(struct constraints *c, int idx)
+{
+  SET_BIT(c->seen, idx);
+  c->count[idx]++;
+}
+
+static void _report(lua_State *l, int error_func, const char *progname,
+		    const char *msg)
+{
+  if (error_func) {
+    lua_rawgeti(l, LUA_REGISTRYINDEX, error_func);
+    lua_pushstring(l, "!");
+    lua_pushstring(l, msg);
+    lua_call(l, 2, 0); // 2 arguments, 0 results. Not protecting against errors.
+  } else if (opterr) {
+    fprintf(stderr, "%s: %s\n", progname, msg);
+  }
+}
+
+/* Check the options seen so far against the constraints, in one pass
+ * over the seen bitset. Every violation is reported (through the error
+ * function if there is one, or stderr if not). Returns 1 if there
+ * were none. */
+int check_constraints(lua_State *l,
+		      struct constraints *c,
+		      struct option *longopts,
+		      const char *progname,
+		      int error_func)
+{
+  int result = 1;
+  int i, j, w;
+
+  for (i=0; i<c->num_opts; i++) {
+    unsigned long *conflicts = &c->conflicts[i * c->nwords];
+    unsigned long *requires = &c->requires[i * c->nwords];
+
+    if (!TEST_BIT(c->seen, i)) {
+      if (TEST_BIT(c->required, i)) {
+	lua_pushfstring(l, "option '--%s' is required", longopts[i].name);
+	_report(l, error_func, progname, lua_tostring(l, -1));
+	lua_pop(l, 1);
+	result = 0;
+      }
+      continue;
+    }
+
+    if (c->max_count[i] && c->count[i] > c->max_count[i]) {
+      lua_pushfstring(l, "option '--%s' may be given at most %d time(s)",
+		      longopts[i].name, c->max_count[i]);
+      _report(l, error_func, progname, lua_tostring(l, -1));
+      lua_pop(l, 1);
+      result = 0;
+    }
+
+    for (w=0; w<c->nwords; w++) {
+      unsigned long bad_conflicts = conflicts[w] & c->seen[w];
+      unsigned long bad_requires = requires[w] & ~c->seen[w];
+
+      for (j = w * WORD_BITS; bad_conflicts || bad_requires; j++) {
+	if ((bad_conflicts & 1) &&
+	    /* don't report a pair twice if both sides declare it */
+	    !(j < i && TEST_BIT(&c->conflicts[j * c->nwords], i))) {
+	  lua_pushfstring(l, "option '--%s' conflicts with '--%s'",
+			  longopts[i].name, longopts[j].name);
+	  _report(l, error_func, progname, lua_tostring(l, -1));
+	  lua_pop(l, 1);
+	  result = 0;
+	}
+	if (bad_requires & 1) {
+	  lua_pushfstring(l, "option '--%s' requires '--%s'",
+			  longopts[i].name, longopts[j].name);
+	  _report(l, error_func, progname, lua_tostring(l, -1));
+	  lua_pop(l, 1);
+	  result = 0;
+	}
+	bad_conflicts >>= 1;
+	bad_requires >>= 1;
+      }
+    }
+  }
+
+  return result;
+}
+
+void free_constraints(struct constraints *c)
+{
+  if (c) {
+    free(c->required);
+    free(c->conflicts);
+    free(c->requires);
+    free(c->max_count);
+    free(c->seen);
+    free(c->count);
+    free(c);
+  }
+}
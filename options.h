@@ -1,3 +1,17 @@
+/* Per-option constraints, compiled into bitsets indexed by the
+ * option's position in the longopts array. */
+struct constraints {
+  int num_opts;
+  int nwords;                /* unsigned longs per bitset */
+  unsigned long *required;   /* options that must be given */
+  unsigned long *conflicts;  /* num_opts bitsets of conflicting options */
+  unsigned long *requires;   /* num_opts bitsets of required companions */
+  int *max_count;            /* 0 for unlimited */
+
+  unsigned long *seen;       /* options seen during this parse */
+  int *count;
+};
+
 struct option * build_longopts(lua_State *l,
 			       int table_idx,
 			       char **bound_variable_name[],
@@ -6,3 +20,19 @@ struct option * build_longopts(lua_State *l,
 void free_longopts(struct option *longopts, 
 		   char *bound_variable_name[],
 		   int bound_variable_value[]);
+
+struct constraints * build_constraints(lua_State *l,
+				       int table_idx,
+				       struct option *longopts);
+
+void reset_constraints(struct constraints *c);
+
+void mark_option(struct constraints *c, int idx);
+
+int check_constraints(lua_State *l,
+		      struct constraints *c,
+		      struct option *longopts,
+		      const char *progname,
+		      int error_func);
+
+void free_constraints(struct constraints *c);
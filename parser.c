@@ -0,0 +1,720 @@
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "argv.h"
+#include "options.h"
+#include "parser.h"
+
+#define ERROR(x) { lua_pushstring(l, x); lua_error(l); }
+
+#define PARSERNAME "getopt.parser"
+
+static void *_grow(void *p, int *size, int needed, size_t elem_size)
+{
+  if (needed > *size) {
+    int new_size = *size ? *size * 2 : 16;
+    while (new_size < needed) {
+      new_size *= 2;
+    }
+    p = realloc(p, elem_size * new_size);
+    *size = new_size;
+  }
+  return p;
+}
+
+static struct parser *_check_parser(lua_State *l, int idx)
+{
+  return (struct parser *)luaL_checkudata(l, idx, PARSERNAME);
+}
+
+static int _longopt_key(struct option *o)
+{
+  if (o->val > 0 && o->val <= 9) {
+    /* Coerce to a character, rather than an integer */
+    return o->val + '0';
+  }
+  return o->val;
+}
+
+static int _add_event(struct parser *p, int key, int opt,
+		      int token, int offset)
+{
+  p->events = _grow(p->events, &p->events_size, p->nevents+1,
+		    sizeof(struct event));
+  p->events[p->nevents].key = key;
+  p->events[p->nevents].opt = opt;
+  p->events[p->nevents].token = token;
+  p->events[p->nevents].offset = offset;
+  return p->nevents++;
+}
+
+static void _add_operand(struct parser *p, int token)
+{
+  p->operands = _grow(p->operands, &p->operands_size, p->noperands+1,
+		      sizeof(int));
+  p->operands[p->noperands++] = token;
+}
+
+/* Returns the has_arg value for short option 'ch', or -1 if 'ch'
+ * isn't in the option string. */
+static int _short_has_arg(const char *optstring, int ch)
+{
+  const char *s;
+
+  /* Skip the '+', '-' and ':' mode prefixes */
+  while (*optstring == '+' || *optstring == '-' || *optstring == ':') {
+    optstring++;
+  }
+  if (ch == ':') {
+    return -1;
+  }
+  s = strchr(optstring, ch);
+  if (!s) {
+    return -1;
+  }
+  if (s[1] != ':') {
+    return no_argument;
+  }
+  return (s[2] == ':') ? optional_argument : required_argument;
+}
+
+/* Find the long option that short option 'ch' stands for (the way
+ * getopt.long does, by its val), or -1 if there isn't one. */
+static int _short_longopt(struct option *longopts, int ch)
+{
+  int i;
+
+  for (i=0; longopts[i].name; i++) {
+    if (longopts[i].val != 0 && longopts[i].val == ch) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Find a long option by name or unambiguous prefix. Returns its
+ * index, or -1 if there's no (unambiguous) match. */
+static int _find_longopt(struct option *longopts, const char *name, size_t len)
+{
+  int i, match = -1, ambiguous = 0;
+
+  for (i=0; longopts[i].name; i++) {
+    if (strncmp(longopts[i].name, name, len)) {
+      continue;
+    }
+    if (strlen(longopts[i].name) == len) {
+      return i;
+    }
+    if (match != -1) {
+      ambiguous = 1;
+    }
+    match = i;
+  }
+
+  return ambiguous ? -1 : match;
+}
+
+/* 'eq' is the offset of the '=' in the token, or -1 if there isn't one */
+static int _parse_long(struct parser *p, int token, int eq_offset)
+{
+  const char *name = p->tokens[token] + 2;
+  const char *eq = eq_offset >= 0 ? p->tokens[token] + eq_offset : NULL;
+  size_t len = eq ? (size_t)(eq - name) : strlen(name);
+  int idx = _find_longopt(p->longopts, name, len);
+  struct option *o;
+
+  if (idx == -1) {
+    return 0;
+  }
+  o = &p->longopts[idx];
+
+  if (eq) {
+    if (o->has_arg == no_argument) {
+      return 0;
+    }
+    _add_event(p, _longopt_key(o), idx, token, eq + 1 - p->tokens[token]);
+  } else if (o->has_arg == required_argument) {
+    p->pending = _add_event(p, _longopt_key(o), idx, -1, 0);
+  } else {
+    _add_event(p, _longopt_key(o), idx, -1, 0);
+  }
+
+  return 1;
+}
+
+static int _parse_short(struct parser *p, int token)
+{
+  const char *s = p->tokens[token];
+  int i;
+
+  for (i=1; s[i]; i++) {
+    int has_arg = _short_has_arg(p->optstring, s[i]);
+    int opt;
+
+    if (has_arg == -1) {
+      return 0;
+    }
+    opt = _short_longopt(p->longopts, s[i]);
+    if (has_arg == no_argument) {
+      _add_event(p, s[i], opt, -1, 0);
+      continue;
+    }
+
+    /* Anything left in the cluster is this option's argument. */
+    if (s[i+1]) {
+      _add_event(p, s[i], opt, token, i+1);
+    } else if (has_arg == required_argument) {
+      p->pending = _add_event(p, s[i], opt, -1, 0);
+    } else {
+      _add_event(p, s[i], opt, -1, 0);
+    }
+    break;
+  }
+
+  return 1;
+}
+
+/* Put a parser into a state that free_parser() can safely clean up. */
+void clear_parser(struct parser *p)
+{
+  memset(p, 0, sizeof(struct parser));
+  p->pending = -1;
+  p->result = 1;
+  p->error_func = LUA_NOREF;
+  p->progname = "getopt";
+}
+
+/* Compile the option string, longopts and any constraints in them
+ * (and hold on to the optional error function) from the given stack
+ * indices. */
+void init_parser(lua_State *l, struct parser *p,
+		 int optstring_idx, int longopts_idx, int error_idx)
+{
+  const char *optstring = lua_tostring(l, optstring_idx);
+
+  p->posixly_correct = (optstring[0] == '+' || getenv("POSIXLY_CORRECT"));
+  p->optstring = malloc(strlen(optstring)+1);
+  strcpy(p->optstring, optstring);
+
+  p->longopts = build_longopts(l, longopts_idx,
+			       &p->bound_variable_name,
+			       &p->bound_variable_value);
+  p->constraints = build_constraints(l, longopts_idx, p->longopts);
+
+  if (error_idx && lua_type(l, error_idx) == LUA_TFUNCTION) {
+    lua_pushvalue(l, error_idx);
+    p->error_func = luaL_ref(l, LUA_REGISTRYINDEX);
+  }
+}
+
+/* Make room for 'n' more tokens (and their checkpoints). */
+static void _reserve_tokens(struct parser *p, int n)
+{
+  if (p->ntokens+n > p->tokens_size) {
+    int tokens_size = p->tokens_size;
+    p->tokens = _grow(p->tokens, &tokens_size, p->ntokens+n, sizeof(char *));
+    if (p->rollback) {
+      p->checkpoints = _grow(p->checkpoints, &p->tokens_size, p->ntokens+n,
+			     sizeof(struct checkpoint));
+    } else {
+      p->tokens_size = tokens_size;
+    }
+  }
+}
+
+/* Append a token (remembering the state from before it, if it might be
+ * rolled back), and return its index. */
+static int _push_token(struct parser *p, char *s)
+{
+  _reserve_tokens(p, 1);
+
+  if (p->rollback) {
+    p->checkpoints[p->ntokens].nevents = p->nevents;
+    p->checkpoints[p->ntokens].noperands = p->noperands;
+    p->checkpoints[p->ntokens].pending = p->pending;
+    p->checkpoints[p->ntokens].done = p->done;
+    p->checkpoints[p->ntokens].result = p->result;
+  }
+
+  p->tokens[p->ntokens] = s;
+  return p->ntokens++;
+}
+
+/* Append a run of 'n' operands in one go. A parser that can be rolled
+ * back needs a checkpoint between each of them, so it takes them one
+ * at a time. */
+static void _add_operand_run(struct parser *p, char *argv[], int n)
+{
+  int i;
+
+  if (n == 0) {
+    return;
+  }
+  if (p->rollback) {
+    for (i=0; i<n; i++) {
+      _add_operand(p, _push_token(p, argv[i]));
+      if (p->posixly_correct) {
+	p->done = 1;
+      }
+    }
+    return;
+  }
+
+  _reserve_tokens(p, n);
+  memcpy(&p->tokens[p->ntokens], argv, sizeof(char *) * n);
+  p->operands = _grow(p->operands, &p->operands_size, p->noperands+n,
+		      sizeof(int));
+  for (i=0; i<n; i++) {
+    p->operands[p->noperands++] = p->ntokens++;
+  }
+  if (p->posixly_correct) {
+    p->done = 1;
+  }
+}
+
+/* Parse one token, of the given ARG_* type (see classify_arg()). */
+static int _feed(lua_State *l, struct parser *p, char *s, int type, int eq)
+{
+  int token = _push_token(p, s);
+  int ok = 1;
+
+  if (p->pending != -1) {
+    /* The previous option was waiting for this as its argument. */
+    p->events[p->pending].token = token;
+    p->events[p->pending].offset = 0;
+    p->pending = -1;
+  } else if (p->done || type == ARG_OPERAND || type == ARG_DASH) {
+    _add_operand(p, token);
+    if (p->posixly_correct) {
+      p->done = 1;
+    }
+  } else if (type == ARG_TERMINATOR) {
+    p->done = 1;
+  } else if (type == ARG_LONG || type == ARG_LONG_VALUE) {
+    ok = _parse_long(p, token, eq);
+  } else {
+    ok = _parse_short(p, token);
+  }
+
+  if (!ok) {
+    p->result = 0;
+    if (p->error_func != LUA_NOREF) {
+      lua_rawgeti(l, LUA_REGISTRYINDEX, p->error_func);
+      lua_pushstring(l, "?");
+      lua_call(l, 1, 0); // 1 argument, 0 results. Not protecting against errors.
+    }
+  }
+
+  return ok;
+}
+
+/* Parse one more token. The parser keeps a pointer to the token (and
+ * frees it later if owns_tokens is set), so it has to outlive any
+ * results taken from the parser. */
+int feed_parser(lua_State *l, struct parser *p, char *s)
+{
+  int eq;
+  int type = classify_arg(s, &eq);
+
+  return _feed(l, p, s, type, eq);
+}
+
+/* Parse a whole argv (without argv[0]) that classify_args() has already
+ * been run over. We jump straight from one option token to the next:
+ * each run of operands between them is added in one go, and once
+ * there's nothing left but operands the rest of argv is too. Returns 0
+ * if any token was bad. */
+int feed_parser_args(lua_State *l, struct parser *p, int argc, char *argv[],
+		     const unsigned char *type, const int *eq)
+{
+  int i = 0, ok = 1;
+
+  while (i < argc) {
+    if (p->pending == -1 &&
+	(p->done || type[i] == ARG_OPERAND || type[i] == ARG_DASH)) {
+      int j = i + 1;
+
+      if (p->done || p->posixly_correct) {
+	j = argc;
+      } else {
+	while (j < argc && (type[j] == ARG_OPERAND || type[j] == ARG_DASH)) {
+	  j++;
+	}
+      }
+      _add_operand_run(p, &argv[i], j - i);
+      i = j;
+      continue;
+    }
+
+    if (!_feed(l, p, argv[i], type[i], eq[i])) {
+      ok = 0;
+    }
+    i++;
+  }
+
+  return ok;
+}
+
+static void _truncate_tokens(struct parser *p, int n)
+{
+  while (p->ntokens > n) {
+    p->ntokens--;
+    if (p->owns_tokens) {
+      free(p->tokens[p->ntokens]);
+    }
+  }
+}
+
+/* Forget everything that's been fed, but keep the compiled options
+ * (and the memory we've already allocated). */
+void reset_parser(struct parser *p)
+{
+  _truncate_tokens(p, 0);
+  p->nevents = 0;
+  p->noperands = 0;
+  p->pending = -1;
+  p->done = 0;
+  p->result = 1;
+}
+
+/* Stores the options seen so far in the table at table_idx (if it's
+ * nonzero), and pushes the result boolean and a list of operands. If
+ * everything parsed, the options are also checked against any
+ * constraints, as getopt.long does once it's seen all of argv. */
+int push_parser_results(lua_State *l, struct parser *p, int table_idx)
+{
+  int i;
+  int result = p->result && p->pending == -1;
+
+  if (table_idx) {
+    for (i=0; i<p->nevents; i++) {
+      struct event *e = &p->events[i];
+      char buf[2] = { e->key, 0 };
+
+      if (!e->key || i == p->pending) {
+	continue;
+      }
+      if (e->token == -1) {
+	lua_pushboolean(l, 1);
+      } else {
+	lua_pushstring(l, p->tokens[e->token] + e->offset);
+      }
+      lua_setfield(l, table_idx, buf);
+    }
+  }
+
+  if (result && p->constraints) {
+    reset_constraints(p->constraints);
+    for (i=0; i<p->nevents; i++) {
+      if (p->events[i].opt != -1) {
+	mark_option(p->constraints, p->events[i].opt);
+      }
+    }
+    result = check_constraints(l, p->constraints, p->longopts, p->progname,
+			       p->error_func != LUA_NOREF ? p->error_func : 0);
+  }
+
+  lua_pushboolean(l, result);
+
+  lua_newtable(l);
+  for (i=0; i<p->noperands; i++) {
+    lua_pushinteger(l, i+1);
+    lua_pushstring(l, p->tokens[p->operands[i]]);
+    lua_rawset(l, -3);
+  }
+
+  return 2;
+}
+
+void free_parser(lua_State *l, struct parser *p)
+{
+  _truncate_tokens(p, 0);
+  free(p->tokens);
+  free(p->checkpoints);
+  free(p->events);
+  free(p->operands);
+  free(p->optstring);
+  free_constraints(p->constraints);
+
+  if (p->longopts) {
+    free_longopts(p->longopts, p->bound_variable_name,
+		  p->bound_variable_value);
+  }
+  if (p->error_func != LUA_NOREF) {
+    luaL_unref(l, LUA_REGISTRYINDEX, p->error_func);
+  }
+
+  clear_parser(p);
+}
+
+/* parser = getopt.parser("opts", longopts[, error_function])
+ *
+ * Builds a resumable parser. The option string and longopts are
+ * compiled once, here; each subsequent :feed() only does the work for
+ * the token it's given.
+ */
+int lgetopt_parser(lua_State *l)
+{
+  struct parser *p;
+
+  int numargs = lua_gettop(l);
+  if ((numargs != 2 && numargs != 3) ||
+      lua_type(l,1) != LUA_TSTRING ||
+      lua_type(l,2) != LUA_TTABLE ||
+      (numargs == 3 &&
+       lua_type(l,3) != LUA_TFUNCTION &&
+       lua_type(l,3) != LUA_TNIL)) {
+    ERROR("usage: getopt.parser(optionstring, longopts[, errorfunc])");
+  }
+
+  p = lua_newuserdata(l, sizeof(struct parser));
+  clear_parser(p);
+
+  /* Attach the metatable first, so that __gc cleans up after us even
+   * if build_longopts() raises an error. */
+  luaL_getmetatable(l, PARSERNAME);
+  lua_setmetatable(l, -2);
+
+  init_parser(l, p, 1, 2, numargs == 3 ? 3 : 0);
+  p->owns_tokens = 1;
+  p->rollback = 1;
+
+  return 1;
+}
+
+/* bool result = getopt.parse("opts", longopts[, opts_out[, error_function]])
+ *
+ * Parses the global 'arg' table in one go, with the same engine as
+ * getopt.parser rather than libc's getopt_long(). argv is classified
+ * up front (see classify_args()), so the engine only stops at option
+ * tokens; operands are handed over, and permuted to the end of 'arg',
+ * a run at a time. Nothing is ever rolled back, so no checkpoints are
+ * kept.
+ *
+ * This is a reduced-feature alternative to getopt.long, not a
+ * replacement: as with getopt.parser, callbacks aren't called, 'flag'
+ * variables aren't set and there's no occurrence log. It also carries
+ * on past a bad option, where getopt.long stops.
+ */
+int lgetopt_parse(lua_State *l)
+{
+  struct parser *p;
+  int argc, arg_idx, result, i, k, o;
+  char **argv = NULL, **permuted;
+  unsigned char *type;
+  int *eq;
+
+  int numargs = lua_gettop(l);
+  if ((numargs < 2 || numargs > 4) ||
+      lua_type(l,1) != LUA_TSTRING ||
+      lua_type(l,2) != LUA_TTABLE ||
+      (numargs >= 3 &&
+       lua_type(l,3) != LUA_TTABLE &&
+       lua_type(l,3) != LUA_TNIL) ||
+      (numargs == 4 &&
+       lua_type(l,4) != LUA_TFUNCTION &&
+       lua_type(l,4) != LUA_TNIL)) {
+    ERROR("usage: getopt.parse(optionstring, longopts[, resulttable[, errorfunc]])");
+  }
+
+  /* A parser object, so that __gc cleans up after us if anything
+   * raises an error. Its tokens are borrowed from argv. */
+  p = lua_newuserdata(l, sizeof(struct parser));
+  clear_parser(p);
+  luaL_getmetatable(l, PARSERNAME);
+  lua_setmetatable(l, -2);
+  init_parser(l, p, 1, 2, numargs == 4 ? 4 : 0);
+
+  /* Construct argc/argv from the magic lua 'arg' table. */
+  lua_getglobal(l, "arg");
+  arg_idx = lua_gettop(l);
+  construct_args(l, arg_idx, &argc, &argv);
+
+  type = malloc(argc ? argc : 1);
+  eq = malloc(sizeof(int) * (argc ? argc : 1));
+  classify_args(argc, argv, type, eq);
+  if (argc > 0) {
+    p->progname = argv[0];
+  }
+
+  if (argc > 1) {
+    feed_parser_args(l, p, argc-1, argv+1, type+1, eq+1);
+  }
+
+  push_parser_results(l, p, numargs >= 3 && lua_type(l,3) == LUA_TTABLE ? 3 : 0);
+  lua_pop(l, 1); /* pop the operands; we put them in 'arg' instead */
+  result = lua_toboolean(l, -1);
+  lua_pop(l, 1);
+
+  /* Permute like GNU getopt does: options (with their arguments, and
+   * any "--") first, then the operands. optind is left pointing at the
+   * first operand. */
+  permuted = malloc(sizeof(char *) * (argc+1));
+  permuted[0] = argv[0];
+  k = 1;
+  for (i=0, o=0; i<p->ntokens; ) {
+    /* Everything up to the next operand is an option... */
+    int next = (o < p->noperands) ? p->operands[o] : p->ntokens;
+
+    memcpy(&permuted[k], &p->tokens[i], sizeof(char *) * (next - i));
+    k += next - i;
+    /* ... and then skip over the run of operands that starts there */
+    for (i = next; o < p->noperands && p->operands[o] == i; o++) {
+      i++;
+    }
+  }
+  optind = k;
+  for (o=0; o<p->noperands; ) {
+    /* Copy each run of adjacent operands in one go */
+    int first = p->operands[o], n = 1;
+
+    while (o+n < p->noperands && p->operands[o+n] == first+n) {
+      n++;
+    }
+    memcpy(&permuted[k], &p->tokens[first], sizeof(char *) * n);
+    k += n;
+    o += n;
+  }
+
+  update_args(l, arg_idx, argc, permuted, argv);
+  lua_pop(l, 1); /* pop 'arg' */
+
+  free(permuted);
+  free(type);
+  free(eq);
+  free_parser(l, p);
+  free_args(argc, argv);
+
+  /* Return 1 item on the stack (boolean) */
+  lua_pushboolean(l, result);
+
+  return 1;
+}
+
+/* bool result = parser:feed("token")
+ *
+ * Consumes one more token. Returns false if that token was bad (an
+ * unknown option, or an argument where none is allowed).
+ */
+static int lparser_feed(lua_State *l)
+{
+  struct parser *p = _check_parser(l, 1);
+  const char *s = luaL_checkstring(l, 2);
+  char *token = malloc(strlen(s)+1);
+
+  strcpy(token, s);
+  lua_pushboolean(l, feed_parser(l, p, token));
+  return 1;
+}
+
+/* n = parser:snapshot()
+ *
+ * Returns a position that can later be handed to parser:rollback().
+ */
+static int lparser_snapshot(lua_State *l)
+{
+  struct parser *p = _check_parser(l, 1);
+
+  lua_pushinteger(l, p->ntokens);
+  return 1;
+}
+
+/* parser:rollback([n])
+ *
+ * Forgets every token fed since snapshot 'n' was taken. With no 'n',
+ * forgets just the last token.
+ */
+static int lparser_rollback(lua_State *l)
+{
+  struct parser *p = _check_parser(l, 1);
+  int n = luaL_optinteger(l, 2, p->ntokens ? p->ntokens - 1 : 0);
+  struct checkpoint *c;
+
+  if (n < 0 || n > p->ntokens) {
+    ERROR("error: rollback position out of range");
+  }
+  if (n == p->ntokens) {
+    return 0;
+  }
+
+  c = &p->checkpoints[n];
+  p->nevents = c->nevents;
+  p->noperands = c->noperands;
+  p->pending = c->pending;
+  p->done = c->done;
+  p->result = c->result;
+
+  _truncate_tokens(p, n);
+
+  return 0;
+}
+
+/* bool result, operands = parser:results([opts_out])
+ *
+ * Stores the options seen so far in opts_out (in the same form that
+ * getopt.long() uses) and returns the non-option arguments as a list.
+ * The result is false if any token failed, or if an option is still
+ * waiting for its argument.
+ */
+static int lparser_results(lua_State *l)
+{
+  struct parser *p = _check_parser(l, 1);
+
+  if (lua_gettop(l) >= 2 &&
+      lua_type(l,2) != LUA_TTABLE &&
+      lua_type(l,2) != LUA_TNIL) {
+    ERROR("usage: parser:results([resulttable])");
+  }
+
+  return push_parser_results(l, p, lua_type(l,2) == LUA_TTABLE ? 2 : 0);
+}
+
+static int lparser_gc(lua_State *l)
+{
+  free_parser(l, _check_parser(l, 1));
+
+  return 0;
+}
+
+/* metatable for parser objects */
+static const luaL_Reg parser_meta[] = {
+  { "__gc", lparser_gc },
+  { NULL,   NULL       }
+};
+
+/* methods for parser objects */
+static const luaL_Reg parser_methods[] = {
+  { "feed",     lparser_feed     },
+  { "snapshot", lparser_snapshot },
+  { "rollback", lparser_rollback },
+  { "results",  lparser_results  },
+  { NULL,       NULL             }
+};
+
+void register_parser(lua_State *l)
+{
+  luaL_newmetatable(l, PARSERNAME);
+
+#if LUA_VERSION_NUM == 501
+  luaL_openlib(l, 0, parser_meta, 0);
+#else
+  luaL_setfuncs(l, parser_meta, 0);
+#endif
+
+  lua_pushliteral(l, "__index");
+  lua_newtable(l);
+#if LUA_VERSION_NUM == 501
+  luaL_openlib(l, 0, parser_methods, 0);
+#else
+  luaL_setfuncs(l, parser_methods, 0);
+#endif
+  lua_rawset(l, -3);                  /* metatable.__index = parser_methods */
+
+  lua_pop(l, 1);                      /* drop metatable */
+}
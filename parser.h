@@ -0,0 +1,61 @@
+/* One recorded option match. The value (if any) isn't copied; it's a
+ * slice of one of the parser's tokens. */
+struct event {
+  int key;      /* result table key character; 0 if nothing is recorded */
+  int opt;      /* index in longopts, or -1 if it isn't there */
+  int token;    /* index of the token holding the value; -1 for boolean */
+  int offset;   /* offset of the value within that token */
+};
+
+/* Everything needed to put the parser back the way it was before a
+ * given token was fed to it. */
+struct checkpoint {
+  int nevents;
+  int noperands;
+  int pending;
+  int done;
+  int result;
+};
+
+struct parser {
+  char *optstring;
+  int owns_tokens; /* tokens are ours to free (rather than borrowed) */
+  int rollback;    /* keep checkpoints, so tokens can be rolled back */
+  int posixly_correct;
+  struct option *longopts;
+  char **bound_variable_name;
+  int *bound_variable_value;
+  struct constraints *constraints; /* NULL if longopts has none */
+  const char *progname;            /* for constraint messages on stderr */
+  int error_func;
+
+  /* tokens[i] was the i'th token fed; checkpoints[i] (if rollback is
+   * set) is the state before it was fed. */
+  int ntokens, tokens_size;
+  char **tokens;
+  struct checkpoint *checkpoints;
+
+  int nevents, events_size;
+  struct event *events;
+
+  int noperands, operands_size;
+  int *operands;
+
+  int pending; /* event waiting for its required argument, or -1 */
+  int done;    /* saw "--" (or an operand, if posixly correct) */
+  int result;  /* 0 once any token has failed */
+};
+
+void clear_parser(struct parser *p);
+void init_parser(lua_State *l, struct parser *p,
+		 int optstring_idx, int longopts_idx, int error_idx);
+int feed_parser(lua_State *l, struct parser *p, char *token);
+int feed_parser_args(lua_State *l, struct parser *p, int argc, char *argv[],
+		     const unsigned char *type, const int *eq);
+void reset_parser(struct parser *p);
+int push_parser_results(lua_State *l, struct parser *p, int table_idx);
+void free_parser(lua_State *l, struct parser *p);
+
+int lgetopt_parser(lua_State *l);
+int lgetopt_parse(lua_State *l);
+void register_parser(lua_State *l);
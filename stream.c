@@ -0,0 +1,238 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "parser.h"
+#include "stream.h"
+
+#define ERROR(x) { lua_pushstring(l, x); lua_error(l); }
+
+#define STREAMNAME "getopt.stream"
+#define STREAM_CHUNK 65536
+
+struct stream {
+  struct parser parser;
+  int fd;
+  int eof;
+
+  /* buf[start..len) is data we've read but not yet handed out; scan is
+   * how far into it we've already looked for a record terminator. */
+  char *buf;
+  int buf_size, start, scan, len;
+};
+
+/* Returns the next NUL-terminated record, read from the stream in
+ * large chunks as needed, or NULL at end of file. The record lives in
+ * the read buffer, so it's only good until the next call. */
+static char *_next_record(lua_State *l, struct stream *s)
+{
+  while (1) {
+    char *end = memchr(s->buf + s->scan, 0, s->len - s->scan);
+    char *rec;
+    int n;
+
+    if (end) {
+      rec = s->buf + s->start;
+      s->start = s->scan = end - s->buf + 1;
+      return rec;
+    }
+    s->scan = s->len;
+
+    if (s->eof) {
+      if (s->start == s->len) {
+	return NULL;
+      }
+      /* An unterminated final record. We always leave room for this. */
+      s->buf[s->len] = 0;
+      rec = s->buf + s->start;
+      s->start = s->scan = s->len;
+      return rec;
+    }
+
+    /* Slide the partial record to the front, and make room for more. */
+    if (s->start) {
+      memmove(s->buf, s->buf + s->start, s->len - s->start);
+      s->len -= s->start;
+      s->scan -= s->start;
+      s->start = 0;
+    }
+    if (s->buf_size - s->len - 1 < STREAM_CHUNK / 2) {
+      s->buf_size *= 2;
+      s->buf = realloc(s->buf, s->buf_size);
+    }
+
+    n = read(s->fd, s->buf + s->len, s->buf_size - s->len - 1);
+    if (n < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      luaL_error(l, "error: read failed: %s", strerror(errno));
+    }
+    if (n == 0) {
+      s->eof = 1;
+    }
+    s->len += n;
+  }
+}
+
+/* Returns the file descriptor behind the Lua file handle at idx,
+ * raising an error if the handle has been closed. */
+static int _file_fd(lua_State *l, int idx)
+{
+#if LUA_VERSION_NUM == 501
+  /* A FILE ** that's set to NULL when the file is closed */
+  FILE **f = luaL_checkudata(l, idx, LUA_FILEHANDLE);
+  if (!*f) {
+    ERROR("error: attempt to use a closed file");
+  }
+  return fileno(*f);
+#else
+  /* A closed luaL_Stream keeps its (dangling) FILE *, but clears closef */
+  luaL_Stream *f = luaL_checkudata(l, idx, LUA_FILEHANDLE);
+  if (!f->closef) {
+    ERROR("error: attempt to use a closed file");
+  }
+  return fileno(f->f);
+#endif
+}
+
+/* bool result, opts, operands = iterator()
+ *
+ * Reads and parses the next record. Tokens are split on whitespace in
+ * place, and fed to the parser straight out of the read buffer.
+ */
+static int _stream_next(lua_State *l)
+{
+  struct stream *s = luaL_checkudata(l, lua_upvalueindex(1), STREAMNAME);
+  char *c;
+
+  /* Don't read from a descriptor that's since been closed (and maybe
+   * reused for some other file). */
+  if (lua_type(l, lua_upvalueindex(2)) == LUA_TUSERDATA) {
+    _file_fd(l, lua_upvalueindex(2));
+  }
+
+  c = _next_record(l, s);
+
+  if (!c) {
+    lua_pushnil(l);
+    return 1;
+  }
+
+  reset_parser(&s->parser);
+  while (*c) {
+    char *token;
+
+    while (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r') {
+      c++;
+    }
+    if (!*c) {
+      break;
+    }
+    token = c;
+    while (*c && *c != ' ' && *c != '\t' && *c != '\n' && *c != '\r') {
+      c++;
+    }
+    if (*c) {
+      *c++ = 0;
+    }
+    feed_parser(l, &s->parser, token);
+  }
+
+  /* Stack is opts, result, operands; shuffle it to result, opts, operands */
+  lua_newtable(l);
+  push_parser_results(l, &s->parser, lua_gettop(l));
+  lua_pushvalue(l, -3);
+  lua_remove(l, -4);
+  lua_insert(l, -2);
+
+  return 3;
+}
+
+/* for result, opts, operands in getopt.stream(file, "opts", longopts[, error_function]) do ... end
+ *
+ * Reads NUL-terminated records from a Lua file handle (or a numeric
+ * file descriptor), and parses each one against the same options. A
+ * record is only read when the loop asks for it.
+ */
+int lgetopt_stream(lua_State *l)
+{
+  struct stream *s;
+  int fd;
+
+  int numargs = lua_gettop(l);
+  if ((numargs != 3 && numargs != 4) ||
+      (lua_type(l,1) != LUA_TNUMBER && lua_type(l,1) != LUA_TUSERDATA) ||
+      lua_type(l,2) != LUA_TSTRING ||
+      lua_type(l,3) != LUA_TTABLE ||
+      (numargs == 4 &&
+       lua_type(l,4) != LUA_TFUNCTION &&
+       lua_type(l,4) != LUA_TNIL)) {
+    ERROR("usage: getopt.stream(file, optionstring, longopts[, errorfunc])");
+  }
+
+  if (lua_type(l,1) == LUA_TNUMBER) {
+    fd = lua_tointeger(l, 1);
+  } else {
+    fd = _file_fd(l, 1);
+  }
+
+  s = lua_newuserdata(l, sizeof(struct stream));
+  memset(s, 0, sizeof(struct stream));
+  clear_parser(&s->parser);
+  s->fd = fd;
+
+  /* Attach the metatable first, so that __gc cleans up after us even
+   * if build_longopts() raises an error. */
+  luaL_getmetatable(l, STREAMNAME);
+  lua_setmetatable(l, -2);
+
+  s->buf_size = STREAM_CHUNK;
+  s->buf = malloc(s->buf_size);
+
+  init_parser(l, &s->parser, 2, 3, numargs == 4 ? 4 : 0);
+
+  /* The file handle is the second upvalue, so that it can't be
+   * collected (and closed) while the iterator is still using it. */
+  lua_pushvalue(l, 1);
+  lua_pushcclosure(l, _stream_next, 2);
+
+  return 1;
+}
+
+static int lstream_gc(lua_State *l)
+{
+  struct stream *s = luaL_checkudata(l, 1, STREAMNAME);
+
+  free_parser(l, &s->parser);
+  free(s->buf);
+  s->buf = NULL;
+
+  return 0;
+}
+
+/* metatable for stream objects */
+static const luaL_Reg stream_meta[] = {
+  { "__gc", lstream_gc },
+  { NULL,   NULL       }
+};
+
+void register_stream(lua_State *l)
+{
+  luaL_newmetatable(l, STREAMNAME);
+
+#if LUA_VERSION_NUM == 501
+  luaL_openlib(l, 0, stream_meta, 0);
+#else
+  luaL_setfuncs(l, stream_meta, 0);
+#endif
+
+  lua_pop(l, 1);                      /* drop metatable */
+}
@@ -0,0 +1,2 @@
+int lgetopt_stream(lua_State *l);
+void register_stream(lua_State *l);
@@ -0,0 +1,140 @@
+#!/usr/bin/env lua
+
+--[[ 
+   getopt.parse() tests:
+  
+   Create a stub script and invoke it with various combinations of
+   arguments. Inspect the output.
+--]]
+
+local posix = require 'posix'
+local os = require "os"
+
+local fn = os.tmpname()
+local tf = assert(io.open(fn, "w+"))
+
+tf:write([[#!/usr/bin/env lua
+local getopt = require "getopt"
+local opts = {}
+local errors = 0
+local longopts = { alpha = { has_arg = "no_argument",
+			     val = "a" },
+		   bravo = { has_arg = "required_argument",
+			     val = "b" },
+		   charlie = { has_arg = "optional_argument",
+			       val = "c" },
+		}
+
+if (arg[1] == "random") then
+   -- Build a large argv of operands with options scattered through it,
+   -- at every alignment, and check the result against what we put in.
+   math.randomseed(tonumber(arg[2]))
+   local t = { [0] = arg[0] }
+   local expect_opts, expect_operands = {}, {}
+   for i = 1, 20000 do
+      local r = math.random(20)
+      if (r == 1) then
+	 table.insert(t, "-a")
+	 expect_opts.a = true
+      elseif (r == 2) then
+	 local v = string.rep("v", math.random(0, 40)) .. i
+	 table.insert(t, "--bravo=" .. v)
+	 expect_opts.b = v
+      elseif (r == 3) then
+	 local v = "x=" .. i
+	 table.insert(t, "-b")
+	 table.insert(t, v)
+	 expect_opts.b = v
+      elseif (r == 4) then
+	 table.insert(t, "-")
+	 table.insert(expect_operands, "-")
+      else
+	 local v = string.rep("o", math.random(0, 70)) .. "=" .. i
+	 table.insert(t, v)
+	 table.insert(expect_operands, v)
+      end
+   end
+   arg = t
+   local ret = getopt.parse("ab:c::", longopts, opts)
+   local ok = ret and opts.a == expect_opts.a and opts.b == expect_opts.b
+   local o = getopt.get_optind()
+   for i, v in ipairs(expect_operands) do
+      if (arg[o + i - 1] ~= v) then
+	 ok = false
+      end
+   end
+   ok = ok and (arg[o + #expect_operands] == nil)
+   print(tostring(ok))
+   return
+end
+
+if (arg[1] == "nul") then
+   -- A Lua string can hold NULs; getopt only sees up to the first one.
+   arg = { [0] = arg[0], "a\0-b\0-c", "-a", "op\0-b" }
+end
+
+local ret = getopt.parse("ab:c::", longopts, opts, function(ch) errors = errors + 1; end)
+
+io.write(string.format("%s %s %s %s %d", tostring(ret), tostring(opts['a'] or "nil"), tostring(opts['b'] or "nil"), tostring(opts['c'] or "nil"), errors))
+local p = getopt.get_optind()
+if (p <= #arg) then
+   io.write(" extras:")
+   while (p <= #arg) do
+      io.write(" " .. arg[p])
+      p = p + 1
+   end
+end
+io.write("\n")
+]])
+tf:close()
+
+posix.chmod(fn, "755")
+
+local tests = {
+   -- simple boolean tests: short; long
+   [' -a'] = "true true nil nil 0",
+   [' --alpha'] = "true true nil nil 0",
+   -- required argument, but it's missing
+   [' -b'] = "false nil nil nil 0",
+   [' --bravo'] = "false nil nil nil 0",
+   -- required argument flavors
+   [' -b foo'] = "true nil foo nil 0",
+   [' -bfoo'] = "true nil foo nil 0",
+   [' -b=foo'] = "true nil =foo nil 0",
+   [' --bravo foo'] = "true nil foo nil 0",
+   [' --bravo=foo'] = "true nil foo nil 0",
+   -- optional argument flavors
+   [' -cfoo'] = "true nil nil foo 0",
+   [' --charlie=foo'] = "true nil nil foo 0",
+   -- bad options are all counted; the parse doesn't stop at the first
+   [' -z --zulu -a'] = "false true nil nil 2",
+   [' --alpha=foo'] = "false nil nil nil 1",
+   -- operands are permuted to the end, as getopt.long does
+   [' -a notanarg --bravo=foo'] = "true true foo nil 0 extras: notanarg",
+   [' one -a two - three -b four'] = "true true four nil 0 extras: one two - three",
+   -- the terminator
+   [' -a -- -b foo'] = "true true nil nil 0 extras: -b foo",
+   [' x -- -a'] = "true nil nil nil 0 extras: x -a",
+   -- embedded NULs end the string, as they would in a C argv
+   [' nul'] = "true true nil nil 0 extras: a op",
+   -- options at every alignment within a large argv
+   [' random 1'] = "true",
+   [' random 2'] = "true",
+   [' random 3'] = "true",
+ }
+
+print "Running getopt.parse tests..."
+for k,v in pairs(tests) do
+   io.write (" '" .. k .. "'... ")
+   -- redirect stderr; we don't need to see the error output
+   local fh = assert(io.popen(fn .. k .. " 2>/dev/null", 'r'))
+   local output = fh:read("*l") -- read one line and compare...
+   if (output == v) then
+      print (" passed")
+   else
+      -- expected the value from the tests table, but got something else...
+      print (" FAILED: got '" .. tostring(output) .. "'")
+   end
+end
+
+os.remove(fn)
@@ -0,0 +1,106 @@
+#!/usr/bin/env lua
+
+--[[ 
+   getopt.parser() tests:
+  
+   Create a stub script that feeds its arguments, one at a time, to an
+   incremental parser. The pseudo-arguments BS (forget the last token),
+   SNAP (take a snapshot) and UNDO (roll back to the snapshot) exercise
+   the rollback machinery. Inspect the output.
+--]]
+
+local posix = require 'posix'
+local os = require "os"
+
+local fn = os.tmpname()
+local tf = assert(io.open(fn, "w+"))
+
+tf:write([[#!/usr/bin/env lua
+local getopt = require "getopt"
+local opts = {}
+local errors = 0
+local longopts = { alpha = { has_arg = "no_argument",
+			     val = "a" },
+		   bravo = { has_arg = "required_argument",
+			     val = "b" },
+		   charlie = { has_arg = "optional_argument",
+			       val = "c" },
+		}
+local p = getopt.parser("ab:c::", longopts, function(ch) errors = errors + 1; end)
+local snap
+for i = 1, #arg do
+   if (arg[i] == "BS") then
+      p:rollback()
+   elseif (arg[i] == "SNAP") then
+      snap = p:snapshot()
+   elseif (arg[i] == "UNDO") then
+      p:rollback(snap)
+   else
+      p:feed(arg[i])
+   end
+end
+local ret, operands = p:results(opts)
+
+io.write(string.format("%s %s %s %s %d", tostring(ret), tostring(opts['a'] or "nil"), tostring(opts['b'] or "nil"), tostring(opts['c'] or "nil"), errors))
+if (#operands > 0) then
+   io.write(" extras: " .. table.concat(operands, " "))
+end
+io.write("\n")
+]])
+tf:close()
+
+posix.chmod(fn, "755")
+
+local tests = {
+   -- simple boolean tests: short; long; clustered
+   [' -a'] = "true true nil nil 0",
+   [' --alpha'] = "true true nil nil 0",
+   [' --al'] = "true true nil nil 0",
+   [' -ab foo'] = "true true foo nil 0",
+   -- required argument, still pending
+   [' -b'] = "false nil nil nil 0",
+   [' --bravo'] = "false nil nil nil 0",
+   -- required argument flavors
+   [' -b foo'] = "true nil foo nil 0",
+   [' -bfoo'] = "true nil foo nil 0",
+   [' --bravo foo'] = "true nil foo nil 0",
+   [' --bravo=foo'] = "true nil foo nil 0",
+   -- optional argument flavors
+   [' -c'] = "true nil nil true 0",
+   [' -cfoo'] = "true nil nil foo 0",
+   [' --charlie=foo'] = "true nil nil foo 0",
+   [' -c foo'] = "true nil nil true 0 extras: foo",
+   -- bad options
+   [' -z'] = "false nil nil nil 1",
+   [' --zulu'] = "false nil nil nil 1",
+   [' --alpha=foo'] = "false nil nil nil 1",
+   -- operands and the "--" terminator
+   [' foo -a bar'] = "true true nil nil 0 extras: foo bar",
+   [' -a -- -b foo'] = "true true nil nil 0 extras: -b foo",
+   [' - -a'] = "true true nil nil 0 extras: -",
+   -- backspace: forget the last token
+   [' -a -z BS'] = "true true nil nil 1",
+   [' -b foo BS'] = "false nil nil nil 0",
+   [' -b foo BS bar'] = "true nil bar nil 0",
+   [' -- BS -b foo'] = "true nil foo nil 0",
+   [' BS -a'] = "true true nil nil 0",
+   -- snapshot and rollback
+   [' -a SNAP -b foo bar -- baz UNDO'] = "true true nil nil 0",
+   [' -a SNAP -b foo bar UNDO -c'] = "true true nil true 0",
+ }
+
+print "Running getopt.parser tests..."
+for k,v in pairs(tests) do
+   io.write (" '" .. k .. "'... ")
+   -- redirect stderr; we don't need to see the error output
+   local fh = assert(io.popen(fn .. k .. " 2>/dev/null", 'r'))
+   local output = fh:read("*l") -- read one line and compare...
+   if (output == v) then
+      print (" passed")
+   else
+      -- expected the value from the tests table, but got something else...
+      print (" FAILED: got '" .. output .. "'")
+   end
+end
+
+os.remove(fn)
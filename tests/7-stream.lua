@@ -0,0 +1,142 @@
+#!/usr/bin/env lua
+
+--[[ 
+   getopt.stream() tests:
+  
+   Create a stub script that parses NUL-terminated records from its
+   stdin, and pipe various combinations of records into it. Inspect
+   the output.
+--]]
+
+local posix = require 'posix'
+local os = require "os"
+
+local fn = os.tmpname()
+local tf = assert(io.open(fn, "w+"))
+
+tf:write([[#!/usr/bin/env lua
+local getopt = require "getopt"
+local errors = 0
+local longopts = { alpha = { has_arg = "no_argument",
+			     val = "a" },
+		   bravo = { has_arg = "required_argument",
+			     val = "b" },
+		}
+local records = {}
+local count = 0
+local last
+for ret, opts, operands in getopt.stream(io.stdin, "ab:", longopts, function(ch) errors = errors + 1; end) do
+   last = string.format("%s %s %s", tostring(ret), tostring(opts['a'] or "nil"), tostring(opts['b'] or "nil"))
+   if (#operands > 0) then
+      last = last .. " extras: " .. table.concat(operands, " ")
+   end
+   table.insert(records, last)
+   count = count + 1
+end
+if (arg[1] == "count") then
+   -- too many records to print; summarize them instead
+   print(string.format("%d %s %d", count, tostring(last), errors))
+else
+   print(table.concat(records, "; ") .. " errors: " .. errors)
+end
+]])
+tf:close()
+
+posix.chmod(fn, "755")
+
+local tests = {
+   -- no records at all
+   ["printf ''"] = " errors: 0",
+   -- single records, with and without the final terminator
+   ["printf -- '-a\\0'"] = "true true nil errors: 0",
+   ["printf -- '-a'"] = "true true nil errors: 0",
+   ["printf -- '--bravo foo\\0'"] = "true nil foo errors: 0",
+   -- whitespace between (and around) tokens
+   ["printf -- ' -a\\t-b \\n foo \\0'"] = "true true foo errors: 0",
+   -- empty records
+   ["printf -- '\\0\\0'"] = "true nil nil; true nil nil errors: 0",
+   -- results don't leak from one record into the next
+   ["printf -- '-a\\0-b foo\\0bar\\0'"] = "true true nil; true nil foo; true nil nil extras: bar errors: 0",
+   -- bad and incomplete records
+   ["printf -- '-z\\0-a\\0'"] = "false nil nil; true true nil errors: 1",
+   ["printf -- '-b\\0-a\\0'"] = "false nil nil; true true nil errors: 0",
+   -- lots of records, spanning many reads
+   ["seq 1 50000 | sed 's/^/-a -b value/' | tr '\\n' '\\0'"] = "count:50000 true true value50000 0",
+   -- one record larger than the read buffer
+   ["(printf -- '-b '; head -c 200000 /dev/zero | tr '\\0' 'x'; printf -- ' -a\\0')"] = "count:1 true true " .. string.rep("x", 200000) .. " 0",
+ }
+
+print "Running getopt.stream tests..."
+for k,v in pairs(tests) do
+   local args = ""
+   if (v:sub(1, 6) == "count:") then
+      v = v:sub(7)
+      args = " count"
+   end
+   io.write (" '" .. k:sub(1, 60) .. "'... ")
+   -- redirect stderr; we don't need to see the error output
+   local fh = assert(io.popen(k .. " | " .. fn .. args .. " 2>/dev/null", 'r'))
+   local output = fh:read("*l") -- read one line and compare...
+   if (output == v) then
+      print (" passed")
+   else
+      -- expected the value from the tests table, but got something else...
+      print (" FAILED: got '" .. tostring(output):sub(1, 200) .. "'")
+   end
+end
+
+-- The iterator has to keep its file handle alive, and notice if it's
+-- been closed.
+local data = os.tmpname()
+local df = assert(io.open(data, "w+"))
+df:write("-a\0-b foo\0bar\0")
+df:close()
+
+tf = assert(io.open(fn, "w+"))
+tf:write([[#!/usr/bin/env lua
+local getopt = require "getopt"
+local longopts = { alpha = { has_arg = "no_argument",
+			     val = "a" },
+		   bravo = { has_arg = "required_argument",
+			     val = "b" },
+		}
+local count = 0
+if (arg[2] == "close") then
+   local fh = assert(io.open(arg[1]))
+   local ok, err = pcall(function()
+			    for ret, opts, operands in getopt.stream(fh, "ab:", longopts) do
+			       count = count + 1
+			       fh:close()
+			    end
+			 end)
+   print(count .. " " .. tostring(err):gsub("^.*: ", ""))
+else
+   for ret, opts, operands in getopt.stream(io.open(arg[1]), "ab:", longopts) do
+      collectgarbage("collect")
+      -- open (and leak) a few files that might reuse the descriptor
+      io.open(arg[1])
+      count = count + 1
+   end
+   print(count)
+end
+]])
+tf:close()
+
+local tests = {
+   [' gc'] = "3",
+   [' close'] = "1 attempt to use a closed file",
+}
+for k,v in pairs(tests) do
+   io.write (" '" .. data .. k .. "'... ")
+   local fh = assert(io.popen(fn .. " " .. data .. k .. " 2>/dev/null", 'r'))
+   local output = fh:read("*l") -- read one line and compare...
+   if (output == v) then
+      print (" passed")
+   else
+      -- expected the value from the tests table, but got something else...
+      print (" FAILED: got '" .. tostring(output) .. "'")
+   end
+end
+
+os.remove(data)
+os.remove(fn)
@@ -0,0 +1,166 @@
+#!/usr/bin/env lua
+
+--[[ 
+   constraint tests, for getopt.long() and for the parser engine's
+   front ends (getopt.parse, getopt.parser and getopt.stream):
+  
+   Create a stub script and invoke it with various combinations of
+   arguments. Inspect the output.
+--]]
+
+local posix = require 'posix'
+local os = require "os"
+
+local fn = os.tmpname()
+local tf = assert(io.open(fn, "w+"))
+
+tf:write([[#!/usr/bin/env lua
+local getopt = require "getopt"
+local opts = {}
+local errors = {}
+local longopts = { alpha = { has_arg = "no_argument",
+			     conflicts = "bravo",
+			     val = "a" },
+		   bravo = { has_arg = "no_argument",
+			     conflicts = { "charlie" },
+			     val = "b" },
+		   charlie = { has_arg = "no_argument",
+			       val = "c" },
+		   delta = { has_arg = "required_argument",
+			     requires = { "echo" },
+			     max_count = 2,
+			     val = "d" },
+		   echo = { has_arg = "no_argument",
+			    val = "e" },
+		   foxtrot = { has_arg = "no_argument",
+			       required = true,
+			       val = "f" },
+		}
+local errfunc = function(ch, msg) table.insert(errors, ch .. " " .. tostring(msg)); end
+
+-- the first argument says which front end to use
+local mode = table.remove(arg, 1)
+local ret
+if (mode == "long") then
+   ret = getopt.long("abcd:ef", longopts, opts, errfunc)
+elseif (mode == "parse") then
+   ret = getopt.parse("abcd:ef", longopts, opts, errfunc)
+elseif (mode == "parser") then
+   local p = getopt.parser("abcd:ef", longopts, errfunc)
+   for _, v in ipairs(arg) do
+      p:feed(v)
+   end
+   ret = p:results(opts)
+elseif (mode == "stream") then
+   local f = io.tmpfile()
+   f:write(table.concat(arg, " ") .. string.char(0))
+   f:seek("set", 0)
+   for r in getopt.stream(f, "abcd:ef", longopts, errfunc) do
+      ret = r
+   end
+   f:close()
+end
+
+table.sort(errors)
+print (string.format("%s %s", tostring(ret), table.concat(errors, "; ")))
+]])
+tf:close()
+
+posix.chmod(fn, "755")
+
+local tests = {
+   -- only the required option
+   [' -f'] = "true ",
+   [' --foxtrot'] = "true ",
+   -- missing the required option
+   [' '] = "false ! option '--foxtrot' is required",
+   [' -a'] = "false ! option '--foxtrot' is required",
+   -- conflicts
+   [' -f -b -c'] = "false ! option '--bravo' conflicts with '--charlie'",
+   [' -f -a -b'] = "false ! option '--alpha' conflicts with '--bravo'",
+   [' -f -a -c'] = "true ",
+   -- requires
+   [' -f -d foo'] = "false ! option '--delta' requires '--echo'",
+   [' -f -d foo -e'] = "true ",
+   -- max_count
+   [' -f -e -d 1 -d 2'] = "true ",
+   [' -f -e -d 1 -d 2 --delta 3'] = "false ! option '--delta' may be given at most 2 time(s)",
+   -- every violation is reported at once
+   [' -a -b -c -d foo'] = "false ! option '--alpha' conflicts with '--bravo'; ! option '--bravo' conflicts with '--charlie'; ! option '--delta' requires '--echo'; ! option '--foxtrot' is required",
+   -- a parse error stops before any constraints are checked
+   [' -z'] = "false ? nil",
+ }
+
+for _, mode in ipairs({ "long", "parse", "parser", "stream" }) do
+   for k,v in pairs(tests) do
+      io.write ("Running getopt." .. mode .. " constraint test '" .. k .. "'... ")
+      -- redirect stderr; we don't need to see the error output
+      local fh = assert(io.popen(fn .. " " .. mode .. k .. " 2>/dev/null", 'r'))
+      local output = fh:read("*l") -- read one line and compare...
+      if (output == v) then
+	 print (" passed")
+      else
+	 -- expected the value from the tests table, but got something else...
+	 print (" FAILED: got '" .. tostring(output) .. "'")
+      end
+   end
+end
+
+-- without an error function, violations go to stderr, prefixed with
+-- argv[0] (or the module name, if 'arg' has no [0])
+tf = assert(io.open(fn, "w+"))
+tf:write([[#!/usr/bin/env lua
+local getopt = require "getopt"
+local longopts = { foxtrot = { has_arg = "no_argument",
+			       required = true,
+			       val = "f" },
+		}
+arg = { [0] = "prog" }
+getopt.long("f", longopts, {})
+arg = {}
+getopt.long("f", longopts, {})
+]])
+tf:close()
+
+local fh = assert(io.popen(fn .. " 2>&1", 'r'))
+for _, expected in ipairs({ "prog: option '--foxtrot' is required",
+			    "getopt: option '--foxtrot' is required" }) do
+   io.write ("Running getopt.long constraint test for stderr, expecting '" .. expected .. "'... ")
+   local output = fh:read("*l")
+   if (output == expected) then
+      print (" passed")
+   else
+      print (" FAILED: got '" .. tostring(output) .. "'")
+   end
+end
+fh:close()
+
+-- a constraint naming an option that doesn't exist is an error, which
+-- should say which name was wrong
+tf = assert(io.open(fn, "w+"))
+tf:write([[#!/usr/bin/env lua
+local getopt = require "getopt"
+local longopts = { alpha = { has_arg = "no_argument",
+			     requires = { "bravo" },
+			     val = "a" },
+		}
+print(select(2, pcall(getopt.long, "a", longopts, {})))
+print(select(2, pcall(getopt.parse, "a", longopts, {})))
+print(select(2, pcall(getopt.parser, "a", longopts)))
+print(select(2, pcall(getopt.stream, io.stdin, "a", longopts)))
+]])
+tf:close()
+
+local fh = assert(io.popen(fn .. " 2>/dev/null", 'r'))
+for _, mode in ipairs({ "long", "parse", "parser", "stream" }) do
+   io.write ("Running getopt." .. mode .. " constraint test for an unknown name... ")
+   local output = fh:read("*l")
+   if (output == "error: conflicts/requires names unknown option 'bravo'") then
+      print (" passed")
+   else
+      print (" FAILED: got '" .. tostring(output) .. "'")
+   end
+end
+fh:close()
+
+os.remove(fn)
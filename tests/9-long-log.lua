@@ -0,0 +1,96 @@
+#!/usr/bin/env lua
+
+--[[ 
+   getopt.long() occurrence log tests:
+  
+   Create a stub script and invoke it with various combinations of
+   arguments. Inspect the output.
+--]]
+
+local posix = require 'posix'
+local os = require "os"
+
+local fn = os.tmpname()
+local tf = assert(io.open(fn, "w+"))
+
+tf:write([[#!/usr/bin/env lua
+local getopt = require "getopt"
+local opts = {}
+local log = {}
+local foxtrot = "unset"
+local longopts = { alpha = { has_arg = "no_argument",
+			     val = "a" },
+		   include = { has_arg = "required_argument",
+			       val = "I" },
+		   charlie = { has_arg = "optional_argument",
+			       val = "c" },
+		   foxtrot = { has_arg = "no_argument",
+			       flag = "foxtrot",
+			       val = "f" },
+		   -- skips over the token after it, by moving optind
+		   skip = { has_arg = "no_argument",
+			    callback = function(i) getopt.set_optind(i + 1) end,
+			    val = "s" },
+		}
+if (arg[1] == "nul") then
+   -- A Lua string can hold NULs; getopt only sees up to the first one.
+   arg = { [0] = arg[0], "a\0-a\0-a", "-Ione", "op\0-a" }
+end
+local ret = getopt.long("aI:c::fs", longopts, opts, nil, log)
+
+local entries = {}
+for i = 1, #log.opt do
+   table.insert(entries, string.format("%s@%d=%s", log.opt[i], log.index[i], tostring(log.optarg[i])))
+end
+print (string.format("%s %d %d %d %s", tostring(ret), #log.opt, #log.index, #log.optarg, table.concat(entries, " ")))
+]])
+tf:close()
+
+posix.chmod(fn, "755")
+
+local tests = {
+   -- nothing matched
+   [' '] = "true 0 0 0 ",
+   [' foo'] = "true 0 0 0 ",
+   -- simple boolean tests: short; long
+   [' -a'] = "true 1 1 1 a@1=false",
+   [' --alpha'] = "true 1 1 1 a@1=false",
+   -- repeated options keep every occurrence, in order
+   [' -I one --include two -Ithree --include=four'] = "true 4 4 4 I@1=one I@3=two I@5=three I@6=four",
+   [' -a -a -a'] = "true 3 3 3 a@1=false a@2=false a@3=false",
+   -- clustered short options
+   [' -aIfoo'] = "true 2 2 2 a@1=false I@1=foo",
+   [' -aI foo -a'] = "true 3 3 3 a@1=false I@1=foo a@3=false",
+   -- optional arguments
+   [' -c -cbar --charlie=baz'] = "true 3 3 3 c@1=false c@2=bar c@3=baz",
+   -- a bound variable
+   [' -f --foxtrot'] = "true 2 2 2 f@1=false f@2=false",
+   -- operands in between don't disturb the order. The index is where
+   -- the option is in 'arg' after getopt has moved the operands to
+   -- the end.
+   [' -I one foo -I two'] = "true 2 2 2 I@1=one I@3=two",
+   [' foo -a bar -Ione - -c'] = "true 3 3 3 a@1=false I@2=one c@3=false",
+   -- embedded NULs end the string, as they would in a C argv
+   [' nul'] = "true 1 1 1 I@1=one",
+   -- a callback that moves optind moves the log along with it
+   [' -s -z -a'] = "true 2 2 2 s@1=false a@3=false",
+   [' -sa -z -I one'] = "true 3 3 3 s@1=false a@1=false I@3=one",
+   [' foo -s -z bar -a'] = "true 2 2 2 s@1=false a@3=false",
+   -- a bad option stops the log where the parse stopped
+   [' -a -z -a'] = "false 1 1 1 a@1=false",
+ }
+
+for k,v in pairs(tests) do
+   io.write ("Running getopt.long log test '" .. k .. "'... ")
+   -- redirect stderr; we don't need to see the error output
+   local fh = assert(io.popen(fn .. k .. " 2>/dev/null", 'r'))
+   local output = fh:read("*l") -- read one line and compare...
+   if (output == v) then
+      print (" passed")
+   else
+      -- expected the value from the tests table, but got something else...
+      print (" FAILED: got '" .. output .. "'")
+   end
+end
+
+os.remove(fn)